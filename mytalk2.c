@@ -1,3 +1,4 @@
+#define _GNU_SOURCE /* splice */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -11,18 +12,168 @@
 #include <pwd.h>
 #include <signal.h>
 #include <ctype.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <stdint.h>
 #include "talk.h"
 #include <ncurses.h>
 
 #define BUFFER_SIZE 1024
 
+#define FRAME_INTERVAL_MS 33 /* Repaint the window at most ~30 times a second */
+#define SCREEN_BUFFER_SIZE (64 * 1024)
+
+#define SCROLLBACK_MAGIC 0x4d54534cU /* "MTSL" */
+#define SCROLLBACK_DATA_SIZE (4 * 1024 * 1024)
+#define SCROLLBACK_MAX_LINES 65536
+#define SCROLLBACK_PAGE_LINES 20
+
+/*
+ * File transfers are framed in-band: FRAME_START, a type byte, a 4-byte
+ * big-endian payload length, then the payload. FRAME_START is stripped from
+ * chat text before it is sent, and frames are only sent between whole chat
+ * messages. The relay does not forward frames.
+ */
+#define FRAME_START '\001'
+#define FRAME_HEADER_LEN 5
+#define FRAME_BEGIN 'B'  /* 8-byte file size, then the file name */
+#define FRAME_DATA 'D'
+#define FRAME_END 'E'
+#define FRAME_ABORT 'A'  /* The sender gave up; discard what was received */
+#define FILE_CHUNK_SIZE (64 * 1024)
+#define CHAT_QUEUE_SIZE (4 * (BUFFER_SIZE + 1)) /* Typed lines waiting for a frame to finish */
+#define PROGRESS_INTERVAL_MS 500
+
+/*
+ * Bench latencies go in a log-linear histogram: values below 2^BENCH_SUB_BITS
+ * ns get a bucket each, and every power of two above that is split into
+ * 2^(BENCH_SUB_BITS-1) buckets, so a percentile is within ~3% of the truth
+ * however long the run is.
+ */
+#define BENCH_SUB_BITS 6
+#define BENCH_BUCKETS ((1 << BENCH_SUB_BITS) + (64 - BENCH_SUB_BITS) * (1 << (BENCH_SUB_BITS - 1)))
+#define BENCH_SETTLE_MS 2000 /* How long to wait for stragglers after the last send */
+
+#define RELAY_MAX_CLIENTS 1024
+#define RELAY_NAME_LEN 32
+#define RELAY_QUEUE_LEN 256           /* Messages a client may have pending */
+#define RELAY_QUEUE_BYTES (256 * 1024) /* Bytes a client may have pending */
+#define RELAY_IOV_MAX 64
+#define RESERVED_FDS 16 /* stdio, the listener, the scrollback file and spares */
+
+/* One serialized message, shared by every client queue that holds it */
+struct relayMsg {
+    int refs;
+    size_t len;
+    char data[];
+};
+
+struct relayClient {
+    int fd;
+    int named;
+    char name[RELAY_NAME_LEN];
+    char in[BUFFER_SIZE];
+    size_t inLen;
+    uint32_t skip;                           /* Bytes of a rejected frame still to discard */
+    struct relayMsg *queue[RELAY_QUEUE_LEN]; /* Ring of pending messages */
+    size_t qHead, qCount;
+    size_t headOff;                          /* Bytes of queue[qHead] already sent */
+    size_t queuedBytes;
+};
+
+/*
+ * Scrollback file layout: this header, then a ring of SCROLLBACK_MAX_LINES
+ * line start positions, then a SCROLLBACK_DATA_SIZE ring of text. Positions
+ * count every byte ever appended, so a line's text lives at pos % dataSize.
+ */
+struct scrollbackHeader {
+    uint32_t magic;
+    uint32_t maxLines;
+    uint64_t dataSize;
+    uint64_t written; /* Total bytes appended */
+    uint64_t lines;   /* Total lines started */
+    uint64_t first;   /* Oldest line whose text has not been overwritten */
+};
+
+struct scrollback {
+    size_t mapSize;
+    struct scrollbackHeader *hdr;
+    uint64_t *index;
+    char *data;
+    uint64_t view;    /* First line of the page on screen; hdr->lines when following */
+};
+
+struct benchBot {
+    int fd;
+    int ready;                /* Seen the relay's "ok" */
+    int sent;
+    long long nextSend;
+    char in[BUFFER_SIZE];
+    size_t inLen;
+};
+
+struct latencyHistogram {
+    uint64_t count;
+    long long max;
+    uint64_t buckets[BENCH_BUCKETS];
+};
+
+struct transfer {
+    int fd;                   /* -1 when idle */
+    char name[256];
+    uint64_t size, done;
+    int shrank;               /* Outgoing file got shorter; ended early */
+    int begun, padding, ending;
+    unsigned char header[FRAME_HEADER_LEN + 1 + 8 + 256]; /* Outgoing frame header not yet written */
+    size_t headerLen, headerOff;
+    uint32_t chunkLeft;       /* Outgoing frame payload not yet written */
+    long long started, lastReport;
+};
+
+enum frameState { FRAME_TEXT, FRAME_HEADER, FRAME_PAYLOAD };
+
+struct frameParser {
+    enum frameState state;
+    unsigned char header[FRAME_HEADER_LEN];
+    size_t headerLen;
+    uint32_t left;            /* Payload bytes still to come */
+    char meta[8 + 256];       /* FRAME_BEGIN payload */
+    size_t metaLen;
+};
+
 int verbosity = 0;
 int acceptConnectionsAutomatically = 0;
 int disableWindowing = 0;
+int relayMode = 0;
+const char *transcriptPath = NULL;
+int benchClients = 0;
+int benchRate = 100;
+int benchMessages = 1000;
+
+/* Incoming text waiting for the next repaint */
+static char screenBuffer[SCREEN_BUFFER_SIZE];
+static size_t screenLen = 0;
+
+static struct scrollback sb;
+
+static struct transfer outgoing = { -1 }, incoming = { -1 };
+static char chatQueue[CHAT_QUEUE_SIZE];
+static size_t chatQueueLen;
+static struct frameParser frame;
+static int splicePipe[2] = { -1, -1 };
 
 void runServer(int port);
+void runRelay(int port);
 void parseCommandLine(int argc, char *argv[], char **hostname, int *port);
 void runClient(const char *hostname, int port);
+void runBench(const char *hostname, int port);
+int connectToServer(const char *hostname, int port);
 void chatMode(int sockfd);
 
 void error(const char *msg) {
@@ -33,7 +184,7 @@ void error(const char *msg) {
 void parseCommandLine(int argc, char *argv[], char **hostname, int *port) {
     int opt;
     long portTmp;
-    while ((opt = getopt(argc, argv, "vaN")) != -1) {
+    while ((opt = getopt(argc, argv, "vaNrl:B:R:M:")) != -1) {
         switch (opt) {
             case 'v':
                 verbosity++;
@@ -44,8 +195,24 @@ void parseCommandLine(int argc, char *argv[], char **hostname, int *port) {
             case 'N':
                 disableWindowing = 1;
                 break;
+            case 'r':
+                relayMode = 1;
+                break;
+            case 'l':
+                transcriptPath = optarg;
+                break;
+            case 'B':
+                benchClients = atoi(optarg);
+                disableWindowing = 1;
+                break;
+            case 'R':
+                benchRate = atoi(optarg);
+                break;
+            case 'M':
+                benchMessages = atoi(optarg);
+                break;
             default:
-                fprintf(stderr, "Usage: %s [-V] [-a] [-N] [hostname] port\n", argv[0]);
+                fprintf(stderr, "Usage: %s [-V] [-a] [-N] [-r] [-l transcript] [-B clients [-R rate] [-M count]] [hostname] port\n", argv[0]);
                 exit(EXIT_FAILURE);
         }
     }
@@ -66,6 +233,10 @@ void parseCommandLine(int argc, char *argv[], char **hostname, int *port) {
         fprintf(stderr, "Error: Port number must be between 1025 and 65535.\n");
         exit(EXIT_FAILURE);
     }
+    if (benchClients < 0 || benchClients > RELAY_MAX_CLIENTS || benchRate <= 0 || benchMessages <= 0) {
+        fprintf(stderr, "Error: -B needs 1 to %d clients and positive -R and -M values.\n", RELAY_MAX_CLIENTS);
+        exit(EXIT_FAILURE);
+    }
     *port = (int) portTmp;
 }
 
@@ -107,6 +278,7 @@ void runServer(int port) {
 
         fflush(stdin);
         printf("Mytalk request from %s@%s. Accept (y/n)? ", username, inet_ntoa(cli_addr.sin_addr));
+        fflush(stdout);
         if (fgets(buffer, BUFFER_SIZE, stdin) == NULL || (strcasecmp(buffer, "y\n") != 0 && strcasecmp(buffer, "yes\n") != 0)) {
             write(newsockfd, deny, strlen(deny));
             close(newsockfd);
@@ -120,18 +292,366 @@ void runServer(int port) {
     close(sockfd);
 }
 
-void runClient(const char *hostname, int port) {
+/* Removes FRAME_START from chat text so it cannot be mistaken for a frame; returns the new length */
+static size_t stripFrameStart(char *text, size_t len) {
+    size_t i, kept = 0;
+
+    for (i = 0; i < len; i++) {
+        if (text[i] != FRAME_START) {
+            text[kept++] = text[i];
+        }
+    }
+    return kept;
+}
+
+static struct relayMsg *relayMsgNew(const char *name, const char *text, size_t len) {
+    size_t nameLen = strlen(name);
+    int newline = (len == 0 || text[len - 1] != '\n');
+    struct relayMsg *msg = malloc(sizeof(*msg) + nameLen + 2 + len + newline);
+    if (msg == NULL) error("ERROR allocating message");
+
+    msg->refs = 0;
+    msg->len = 0;
+    memcpy(msg->data, name, nameLen);
+    msg->len += nameLen;
+    memcpy(msg->data + msg->len, ": ", 2);
+    msg->len += 2;
+    memcpy(msg->data + msg->len, text, len);
+    msg->len += len;
+    if (newline) {
+        msg->data[msg->len++] = '\n';
+    }
+    msg->len = stripFrameStart(msg->data, msg->len);
+    return msg;
+}
+
+static void relayMsgRelease(struct relayMsg *msg) {
+    if (--msg->refs == 0) {
+        free(msg);
+    }
+}
+
+static void relayDropClient(struct relayClient *c) {
+    while (c->qCount > 0) {
+        relayMsgRelease(c->queue[c->qHead]);
+        c->qHead = (c->qHead + 1) % RELAY_QUEUE_LEN;
+        c->qCount--;
+    }
+    close(c->fd);
+    c->fd = -1;
+}
+
+/* Writes the client's queue with writev until it is empty or the socket is full */
+static void relayFlush(struct relayClient *c) {
+    struct iovec iov[RELAY_IOV_MAX];
+    int done = 0;
+
+    while (!done && c->qCount > 0) {
+        int iovcnt = 0;
+        size_t i, total = 0;
+        ssize_t sent;
+
+        for (i = 0; i < c->qCount && iovcnt < RELAY_IOV_MAX; i++) {
+            struct relayMsg *msg = c->queue[(c->qHead + i) % RELAY_QUEUE_LEN];
+            size_t off = (i == 0) ? c->headOff : 0;
+            iov[iovcnt].iov_base = msg->data + off;
+            iov[iovcnt].iov_len = msg->len - off;
+            total += iov[iovcnt].iov_len;
+            iovcnt++;
+        }
+
+        sent = writev(c->fd, iov, iovcnt);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                relayDropClient(c);
+            }
+            return;
+        }
+
+        c->queuedBytes -= sent;
+        if ((size_t)sent < total) {
+            done = 1; /* Socket buffer is full; wait for POLLOUT */
+        }
+        while (sent > 0) {
+            struct relayMsg *msg = c->queue[c->qHead];
+            size_t left = msg->len - c->headOff;
+            if ((size_t)sent < left) {
+                c->headOff += sent;
+                break;
+            }
+            sent -= left;
+            c->headOff = 0;
+            relayMsgRelease(msg);
+            c->qHead = (c->qHead + 1) % RELAY_QUEUE_LEN;
+            c->qCount--;
+        }
+    }
+}
+
+/*
+ * Queues msg on c. A full queue is first flushed to the socket, so only a
+ * client whose socket is really backed up is dropped as too slow.
+ */
+static void relayEnqueue(struct relayClient *c, struct relayMsg *msg) {
+    if (c->qCount == RELAY_QUEUE_LEN || c->queuedBytes + msg->len > RELAY_QUEUE_BYTES) {
+        relayFlush(c);
+        if (c->fd < 0) {
+            return;
+        }
+    }
+    if (c->qCount == RELAY_QUEUE_LEN || c->queuedBytes + msg->len > RELAY_QUEUE_BYTES) {
+        if (verbosity > 0) {
+            fprintf(stderr, "Dropping slow client %s\n", c->name);
+        }
+        relayDropClient(c);
+        return;
+    }
+    msg->refs++;
+    c->queue[(c->qHead + c->qCount) % RELAY_QUEUE_LEN] = msg;
+    c->qCount++;
+    c->queuedBytes += msg->len;
+}
+
+static void relayBroadcast(struct relayClient *clients, int nclients, struct relayClient *from, struct relayMsg *msg) {
+    int i;
+    msg->refs++; /* Hold a reference so the message outlives a failed enqueue */
+    for (i = 0; i < nclients; i++) {
+        if (&clients[i] != from && clients[i].fd >= 0 && clients[i].named) {
+            relayEnqueue(&clients[i], msg);
+        }
+    }
+    relayMsgRelease(msg);
+}
+
+static void relayAnnounce(struct relayClient *clients, int nclients, struct relayClient *c, const char *what) {
+    char text[BUFFER_SIZE];
+    int len = snprintf(text, sizeof(text), "%s %s", c->name, what);
+    relayBroadcast(clients, nclients, c, relayMsgNew("relay", text, len));
+}
+
+/* Splits the client's input into NUL-terminated messages; the first one is the username */
+static void relayHandleInput(struct relayClient *clients, int nclients, struct relayClient *c) {
+    static const char ok[] = "ok\n";
+    static const char noFiles[] = "file transfers are not supported in a relay room\n";
+    size_t start = 0;
+    char *nul;
+
+    while (c->fd >= 0) {
+        char *text = c->in + start;
+        size_t len;
+
+        /* Frames carry binary payloads for a single peer; discard them and tell the sender */
+        if (c->skip > 0) {
+            size_t n = (c->inLen - start < c->skip) ? c->inLen - start : c->skip;
+            start += n;
+            c->skip -= n;
+            if (c->skip > 0) {
+                break;
+            }
+            continue;
+        }
+        if (c->named && start < c->inLen && *text == FRAME_START) {
+            uint32_t netLen;
+            if (c->inLen - start < FRAME_HEADER_LEN + 1) {
+                break;
+            }
+            if (text[1] == FRAME_BEGIN) {
+                relayEnqueue(c, relayMsgNew("relay", noFiles, sizeof(noFiles) - 1));
+            }
+            memcpy(&netLen, text + 2, sizeof(netLen));
+            c->skip = ntohl(netLen);
+            start += FRAME_HEADER_LEN + 1;
+            continue;
+        }
+
+        if ((nul = memchr(text, '\0', c->inLen - start)) == NULL) {
+            break;
+        }
+        len = nul - text;
+        start += len + 1;
+
+        if (!c->named) {
+            snprintf(c->name, sizeof(c->name), "%.*s", (int)len, text);
+            c->named = 1;
+            relayEnqueue(c, relayMsgNew("relay", ok, sizeof(ok) - 1));
+            relayAnnounce(clients, nclients, c, "joined");
+            if (verbosity > 0) {
+                fprintf(stderr, "%s joined\n", c->name);
+            }
+        } else if (len > 0) {
+            relayBroadcast(clients, nclients, c, relayMsgNew(c->name, text, len));
+        }
+    }
+
+    if (c->fd < 0) {
+        return;
+    }
+    if (start > 0) {
+        memmove(c->in, c->in + start, c->inLen - start);
+        c->inLen -= start;
+    } else if (c->inLen == sizeof(c->in)) {
+        /* An unterminated message filled the buffer; relay what we have */
+        if (!c->named) {
+            relayDropClient(c);
+            return;
+        }
+        relayBroadcast(clients, nclients, c, relayMsgNew(c->name, c->in, c->inLen));
+        c->inLen = 0;
+    }
+}
+
+/*
+ * Raises the soft descriptor limit far enough for want sockets if the hard
+ * limit allows, and returns how many sockets fit under the resulting limit.
+ */
+static int raiseFileLimit(int want) {
+    struct rlimit rl;
+    rlim_t need = (rlim_t)want + RESERVED_FDS;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1) {
+        return want;
+    }
+    if (rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < need) {
+        rl.rlim_cur = (rl.rlim_max == RLIM_INFINITY || rl.rlim_max >= need) ? need : rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        getrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur >= need) {
+        return want;
+    }
+    return rl.rlim_cur > RESERVED_FDS ? (int)(rl.rlim_cur - RESERVED_FDS) : 0;
+}
+
+void runRelay(int port) {
     int sockfd;
+    int optval = 1;
     struct sockaddr_in serv_addr;
-    struct hostent *server;
-    struct passwd *pw;
-    char *username;
+    struct relayClient *clients;
+    struct pollfd *fds;
+    int nclients = 0;
+    int maxClients = raiseFileLimit(RELAY_MAX_CLIENTS);
+    int acceptPaused = 0;
+    int announced;
+    int i;
 
-    pw = getpwuid(getuid());
-    if (pw == NULL) {
-        error("Failed to get user information");
+    signal(SIGPIPE, SIG_IGN); /* Dead peers are reported by writev instead */
+
+    if (maxClients <= 0) {
+        fprintf(stderr, "Error: not enough file descriptors for any clients\n");
+        exit(EXIT_FAILURE);
     }
-    username = pw->pw_name;
+    if (verbosity > 0 && maxClients < RELAY_MAX_CLIENTS) {
+        fprintf(stderr, "Descriptor limit allows %d clients\n", maxClients);
+    }
+    clients = calloc(maxClients, sizeof(*clients));
+    fds = calloc(maxClients + 1, sizeof(*fds));
+    if (clients == NULL || fds == NULL) error("ERROR allocating clients");
+
+    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) error("ERROR opening socket");
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = INADDR_ANY;
+    serv_addr.sin_port = htons(port);
+
+    if (bind(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
+        error("ERROR on binding");
+
+    listen(sockfd, SOMAXCONN);
+    fcntl(sockfd, F_SETFL, O_NONBLOCK);
+
+    while (1) {
+        fds[0].fd = sockfd;
+        fds[0].events = (nclients < maxClients && !acceptPaused) ? POLLIN : 0;
+        for (i = 0; i < nclients; i++) {
+            fds[i + 1].fd = clients[i].fd;
+            fds[i + 1].events = POLLIN | (clients[i].qCount > 0 ? POLLOUT : 0);
+            fds[i + 1].revents = 0;
+        }
+
+        if (poll(fds, nclients + 1, -1) == -1) {
+            if (errno == EINTR) continue;
+            error("poll failed");
+        }
+
+        for (i = 0; i < nclients; i++) {
+            struct relayClient *c = &clients[i];
+            if (c->fd < 0) {
+                continue;
+            }
+            if (fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) {
+                ssize_t bytesRead = recv(c->fd, c->in + c->inLen, sizeof(c->in) - c->inLen, 0);
+                if (bytesRead > 0) {
+                    c->inLen += bytesRead;
+                    relayHandleInput(clients, nclients, c);
+                } else if (bytesRead == 0 || (errno != EAGAIN && errno != EINTR)) {
+                    relayDropClient(c);
+                }
+            }
+        }
+
+        /* Fan out everything queued this round */
+        for (i = 0; i < nclients; i++) {
+            if (clients[i].fd >= 0 && clients[i].qCount > 0) {
+                relayFlush(&clients[i]);
+            }
+        }
+
+        /* Announce everyone who hung up or was dropped as slow; announcing can drop more */
+        do {
+            announced = 0;
+            for (i = 0; i < nclients; i++) {
+                if (clients[i].fd < 0 && clients[i].named) {
+                    clients[i].named = 0;
+                    relayAnnounce(clients, nclients, &clients[i], "left");
+                    if (verbosity > 0) {
+                        fprintf(stderr, "%s left\n", clients[i].name);
+                    }
+                    announced = 1;
+                }
+            }
+        } while (announced);
+
+        for (i = 0; i < nclients; ) {
+            if (clients[i].fd < 0) {
+                clients[i] = clients[--nclients];
+                acceptPaused = 0;
+            } else {
+                i++;
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int newsockfd;
+            while (nclients < maxClients) {
+                newsockfd = accept(sockfd, NULL, NULL);
+                if (newsockfd < 0) {
+                    if (errno == EMFILE || errno == ENFILE) {
+                        /* The listener stays readable; stop polling it until a client leaves */
+                        acceptPaused = 1;
+                        if (verbosity > 0) {
+                            fprintf(stderr, "Out of file descriptors; pausing accepts\n");
+                        }
+                    }
+                    break;
+                }
+                fcntl(newsockfd, F_SETFL, O_NONBLOCK);
+                memset(&clients[nclients], 0, sizeof(clients[nclients]));
+                clients[nclients].fd = newsockfd;
+                nclients++;
+            }
+        }
+    }
+    close(sockfd);
+}
+
+int connectToServer(const char *hostname, int port) {
+    int sockfd;
+    struct sockaddr_in serv_addr;
+    struct hostent *server;
 
     sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd < 0) 
@@ -151,6 +671,22 @@ void runClient(const char *hostname, int port) {
     if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
         error("ERROR connecting");
 
+    return sockfd;
+}
+
+void runClient(const char *hostname, int port) {
+    int sockfd;
+    struct passwd *pw;
+    char *username;
+
+    pw = getpwuid(getuid());
+    if (pw == NULL) {
+        error("Failed to get user information");
+    }
+    username = pw->pw_name;
+
+    sockfd = connectToServer(hostname, port);
+
     send(sockfd, username, strlen(username)+1, 0);
 
     chatMode(sockfd);
@@ -158,23 +694,640 @@ void runClient(const char *hostname, int port) {
     close(sockfd);
 }
 
+static long long nowNanos(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long long nowMillis(void) {
+    return nowNanos() / 1000000;
+}
+
+/* Hands everything buffered to the display in a single call */
+static void flushScreen(void) {
+    size_t off = 0;
+
+    if (screenLen == 0) {
+        return;
+    }
+    if (disableWindowing) {
+        fflush(stdout); /* Keep prompts and notices printed through stdio in order */
+        while (off < screenLen) {
+            ssize_t n = write(STDOUT_FILENO, screenBuffer + off, screenLen - off);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            off += n;
+        }
+    } else {
+        write_to_output(screenBuffer, screenLen);
+    }
+    screenLen = 0;
+}
+
+/*
+ * Maps the scrollback ring. With no path it lives in an unlinked temporary
+ * file; otherwise the file is kept as a transcript and appended to across
+ * sessions.
+ */
+static void scrollbackOpen(const char *path) {
+    struct stat st;
+    size_t indexSize = SCROLLBACK_MAX_LINES * sizeof(uint64_t);
+    int fd;
+    void *map;
+
+    if (path == NULL) {
+        char tmpl[] = "/tmp/mytalk-XXXXXX";
+        fd = mkstemp(tmpl);
+        if (fd >= 0) unlink(tmpl);
+    } else {
+        fd = open(path, O_RDWR | O_CREAT, 0600);
+    }
+    if (fd < 0 || fstat(fd, &st) < 0) error("ERROR opening scrollback");
+
+    sb.mapSize = sizeof(struct scrollbackHeader) + indexSize + SCROLLBACK_DATA_SIZE;
+
+    /* Check an existing file before touching it; only a new, empty one gets sized */
+    if (st.st_size > 0) {
+        struct scrollbackHeader existing;
+        if (pread(fd, &existing, sizeof(existing), 0) != (ssize_t)sizeof(existing) || existing.magic != SCROLLBACK_MAGIC) {
+            fprintf(stderr, "%s is not a mytalk transcript\n", path);
+            exit(EXIT_FAILURE);
+        }
+        if (existing.maxLines != SCROLLBACK_MAX_LINES || existing.dataSize != SCROLLBACK_DATA_SIZE ||
+            (size_t)st.st_size != sb.mapSize) {
+            fprintf(stderr, "%s was written with a different scrollback size\n", path);
+            exit(EXIT_FAILURE);
+        }
+    } else if (ftruncate(fd, sb.mapSize) < 0) {
+        error("ERROR sizing scrollback");
+    }
+
+    map = mmap(NULL, sb.mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) error("ERROR mapping scrollback");
+
+    sb.hdr = map;
+    sb.index = (uint64_t *)(sb.hdr + 1);
+    sb.data = (char *)map + sizeof(struct scrollbackHeader) + indexSize;
+
+    if (st.st_size == 0) {
+        sb.hdr->magic = SCROLLBACK_MAGIC;
+        sb.hdr->maxLines = SCROLLBACK_MAX_LINES;
+        sb.hdr->dataSize = SCROLLBACK_DATA_SIZE;
+    }
+    sb.view = sb.hdr->lines;
+}
+
+static void scrollbackClose(void) {
+    if (sb.hdr != NULL) {
+        munmap(sb.hdr, sb.mapSize);
+        sb.hdr = NULL;
+    }
+}
+
+/* Copies text into the ring, recording where each new line starts */
+static void scrollbackAppend(const char *text, size_t len) {
+    struct scrollbackHeader *h = sb.hdr;
+    int following = (sb.view == h->lines);
+
+    while (len > 0) {
+        const char *nl = memchr(text, '\n', len);
+        size_t chunk = nl ? (size_t)(nl - text) + 1 : len;
+        size_t done = 0;
+
+        if (h->written == 0 || sb.data[(h->written - 1) % h->dataSize] == '\n') {
+            sb.index[h->lines % h->maxLines] = h->written;
+            h->lines++;
+        }
+        while (done < chunk) {
+            size_t pos = (h->written + done) % h->dataSize;
+            size_t n = chunk - done;
+            if (n > h->dataSize - pos) n = h->dataSize - pos;
+            memcpy(sb.data + pos, text + done, n);
+            done += n;
+        }
+        h->written += chunk;
+        text += chunk;
+        len -= chunk;
+    }
+
+    /* Forget lines that have been evicted from either ring */
+    if (h->lines - h->first > h->maxLines) {
+        h->first = h->lines - h->maxLines;
+    }
+    while (h->first < h->lines && h->written - sb.index[h->first % h->maxLines] > h->dataSize) {
+        h->first++;
+    }
+    if (following || sb.view < h->first) {
+        sb.view = following ? h->lines : h->first;
+    }
+}
+
+/* Shows the SCROLLBACK_PAGE_LINES lines starting at sb.view */
+static void scrollbackShowPage(void) {
+    struct scrollbackHeader *h = sb.hdr;
+    uint64_t last = sb.view + SCROLLBACK_PAGE_LINES;
+    uint64_t pos, end;
+
+    if (last > h->lines) last = h->lines;
+    pos = sb.index[sb.view % h->maxLines];
+    end = (last < h->lines) ? sb.index[last % h->maxLines] : h->written;
+
+    flushScreen();
+    screenLen = snprintf(screenBuffer, SCREEN_BUFFER_SIZE, "--- lines %llu-%llu of %llu ---\n",
+                         (unsigned long long)(sb.view - h->first + 1),
+                         (unsigned long long)(last - h->first),
+                         (unsigned long long)(h->lines - h->first));
+    while (pos < end && screenLen < SCREEN_BUFFER_SIZE) {
+        size_t off = pos % h->dataSize;
+        size_t n = end - pos;
+        if (n > h->dataSize - off) n = h->dataSize - off;
+        if (n > SCREEN_BUFFER_SIZE - screenLen) n = SCREEN_BUFFER_SIZE - screenLen;
+        memcpy(screenBuffer + screenLen, sb.data + off, n);
+        screenLen += n;
+        pos += n;
+    }
+    flushScreen();
+}
+
+static void reportTransfer(const char *verb, struct transfer *t, int final) {
+    long long now = nowMillis();
+    double secs;
+
+    if (!final && now - t->lastReport < PROGRESS_INTERVAL_MS) {
+        return;
+    }
+    t->lastReport = now;
+    secs = (now - t->started) / 1000.0;
+    flushScreen();
+    fprint_to_output("%s %s: %.1f of %.1f MB (%.1f MB/s)%s\n", verb, t->name,
+                     t->done / 1e6, t->size / 1e6, secs > 0 ? t->done / 1e6 / secs : 0.0,
+                     final ? ", done" : "");
+}
+
+static void queueFrameHeader(char type, uint32_t len) {
+    uint32_t netLen = htonl(len);
+
+    outgoing.header[0] = FRAME_START;
+    outgoing.header[1] = type;
+    memcpy(outgoing.header + 2, &netLen, sizeof(netLen));
+    outgoing.headerLen = FRAME_HEADER_LEN + 1;
+    outgoing.headerOff = 0;
+}
+
+/* Opens a file for /send; its frames go out from sendPending as the socket allows */
+static void startTransfer(const char *path) {
+    struct stat st;
+    const char *base = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    size_t nameLen = strlen(base);
+
+    if (outgoing.fd >= 0) {
+        fprint_to_output("Already sending %s\n", outgoing.name);
+        return;
+    }
+    if (nameLen == 0 || nameLen >= sizeof(outgoing.name)) {
+        fprint_to_output("Bad file name: %s\n", path);
+        return;
+    }
+    outgoing.fd = open(path, O_RDONLY);
+    if (outgoing.fd < 0 || fstat(outgoing.fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        fprint_to_output("Cannot send %s: %s\n", path, outgoing.fd < 0 ? strerror(errno) : "not a regular file");
+        if (outgoing.fd >= 0) close(outgoing.fd);
+        outgoing.fd = -1;
+        return;
+    }
+
+    snprintf(outgoing.name, sizeof(outgoing.name), "%s", base);
+    outgoing.size = st.st_size;
+    outgoing.done = 0;
+    outgoing.shrank = outgoing.begun = outgoing.padding = outgoing.ending = 0;
+    outgoing.started = outgoing.lastReport = nowMillis();
+}
+
+/* Queues the next frame of the outgoing file; only called between chat messages */
+static void nextFrame(void) {
+    uint32_t chunk = FILE_CHUNK_SIZE;
+    size_t nameLen = strlen(outgoing.name);
+    uint64_t size = outgoing.size;
+    struct stat st;
+    int i;
+
+    if (!outgoing.begun) {
+        queueFrameHeader(FRAME_BEGIN, 8 + nameLen);
+        for (i = 7; i >= 0; i--) {
+            outgoing.header[outgoing.headerLen + i] = size & 0xff;
+            size >>= 8;
+        }
+        memcpy(outgoing.header + outgoing.headerLen + 8, outgoing.name, nameLen);
+        outgoing.headerLen += 8 + nameLen;
+        outgoing.begun = 1;
+        return;
+    }
+    if (outgoing.padding) {
+        /* The file shrank after a data header went out; the receiver must discard it */
+        queueFrameHeader(FRAME_ABORT, 0);
+        outgoing.ending = 1;
+        return;
+    }
+
+    /* If the file shrank, send what is left of it and end early; the receiver sees the size mismatch */
+    if (fstat(outgoing.fd, &st) == 0 && (uint64_t)st.st_size < outgoing.size) {
+        outgoing.size = ((uint64_t)st.st_size > outgoing.done) ? (uint64_t)st.st_size : outgoing.done;
+        outgoing.shrank = 1;
+    }
+    if (outgoing.done == outgoing.size) {
+        queueFrameHeader(FRAME_END, 0);
+        outgoing.ending = 1;
+        return;
+    }
+    if (outgoing.size - outgoing.done < chunk) {
+        chunk = outgoing.size - outgoing.done;
+    }
+    queueFrameHeader(FRAME_DATA, chunk);
+    outgoing.chunkLeft = chunk;
+}
+
+static void finishOutgoing(void) {
+    close(outgoing.fd);
+    outgoing.fd = -1;
+    outgoing.ending = 0;
+    if (outgoing.padding || outgoing.shrank) {
+        fprint_to_output("Sending %s failed: file shrank\n", outgoing.name);
+    } else {
+        reportTransfer("Sent", &outgoing, 1);
+    }
+}
+
+/*
+ * Writes as much as the socket takes without blocking: the current frame's
+ * header, then its file data straight from the page cache, and between
+ * frames any chat lines typed meanwhile, so chat never lands inside a frame.
+ * Stops after each file chunk so typed lines and repaints get a turn.
+ * Returns -1 if the connection failed.
+ */
+static int sendPending(int sockfd) {
+    while (1) {
+        ssize_t n;
+
+        if (outgoing.headerOff < outgoing.headerLen) {
+            n = send(sockfd, outgoing.header + outgoing.headerOff, outgoing.headerLen - outgoing.headerOff,
+                     MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+            }
+            outgoing.headerOff += n;
+            continue;
+        }
+
+        if (outgoing.chunkLeft > 0) {
+            if (outgoing.padding) {
+                /* Keep the stream in step after a short read */
+                static const char zeros[BUFFER_SIZE];
+                size_t pad = outgoing.chunkLeft < sizeof(zeros) ? outgoing.chunkLeft : sizeof(zeros);
+                n = send(sockfd, zeros, pad, MSG_DONTWAIT | MSG_NOSIGNAL);
+            } else {
+                n = sendfile(sockfd, outgoing.fd, NULL, outgoing.chunkLeft);
+                if (n == 0) {
+                    outgoing.padding = 1;
+                    continue;
+                }
+            }
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+            }
+            outgoing.chunkLeft -= n;
+            if (!outgoing.padding) {
+                outgoing.done += n;
+            }
+            if (outgoing.chunkLeft == 0 && !outgoing.padding) {
+                reportTransfer("Sending", &outgoing, 0);
+                return 0;
+            }
+            continue;
+        }
+
+        /* Between frames */
+        if (outgoing.ending) {
+            finishOutgoing();
+        }
+        if (chatQueueLen > 0) {
+            n = send(sockfd, chatQueue, chatQueueLen, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+            }
+            memmove(chatQueue, chatQueue + n, chatQueueLen - n);
+            chatQueueLen -= n;
+            continue;
+        }
+        if (outgoing.fd < 0) {
+            return 0;
+        }
+        nextFrame();
+    }
+}
+
+/* Abandons the file being received, removing the partial copy */
+static void closeIncoming(const char *why) {
+    if (incoming.fd >= 0) {
+        close(incoming.fd);
+        incoming.fd = -1;
+        unlink(incoming.name);
+        flushScreen();
+        fprint_to_output("Receiving %s failed: %s\n", incoming.name, why);
+    }
+}
+
+static void writeIncoming(const char *data, size_t len) {
+    while (len > 0 && incoming.fd >= 0) {
+        ssize_t n = write(incoming.fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            closeIncoming(strerror(errno));
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+static void frameComplete(void) {
+    if (frame.header[0] == FRAME_BEGIN && frame.metaLen > 8) {
+        char name[sizeof(incoming.name)];
+        uint64_t size = 0;
+        size_t i;
+
+        closeIncoming("interrupted by a new transfer");
+        for (i = 0; i < 8; i++) {
+            size = (size << 8) | (unsigned char)frame.meta[i];
+        }
+        snprintf(name, sizeof(name), "%.*s", (int)(frame.metaLen - 8), frame.meta + 8);
+        snprintf(incoming.name, sizeof(incoming.name), "%s", strrchr(name, '/') ? strrchr(name, '/') + 1 : name);
+        incoming.size = size;
+        incoming.done = 0;
+        incoming.started = incoming.lastReport = nowMillis();
+
+        flushScreen();
+        /* Leading dots cover ".", ".." and dotfiles such as .bashrc */
+        if (incoming.name[0] == '.' || incoming.name[0] == '\0') {
+            fprint_to_output("Refusing file with bad name %s\n", name);
+        } else if ((incoming.fd = open(incoming.name, O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0) {
+            fprint_to_output("Cannot receive %s: %s\n", incoming.name, strerror(errno));
+        } else {
+            fprint_to_output("Receiving %s (%.1f MB)\n", incoming.name, size / 1e6);
+        }
+    } else if (frame.header[0] == FRAME_END && incoming.fd >= 0) {
+        if (incoming.done != incoming.size) {
+            closeIncoming("truncated");
+        } else {
+            close(incoming.fd);
+            incoming.fd = -1;
+            reportTransfer("Received", &incoming, 1);
+        }
+    } else if (frame.header[0] == FRAME_ABORT) {
+        closeIncoming("cancelled by sender");
+    }
+    frame.state = FRAME_TEXT;
+}
+
+static void framePayload(const char *data, size_t len) {
+    if (frame.header[0] == FRAME_DATA) {
+        writeIncoming(data, len);
+        incoming.done += len;
+        if (incoming.fd >= 0) {
+            reportTransfer("Receiving", &incoming, 0);
+        }
+    } else if (frame.header[0] == FRAME_BEGIN) {
+        size_t n = sizeof(frame.meta) - frame.metaLen;
+        if (n > len) n = len;
+        memcpy(frame.meta + frame.metaLen, data, n);
+        frame.metaLen += n;
+    }
+}
+
+/*
+ * Runs the frame parser over len freshly received bytes at text. Chat text is
+ * compacted in place to the front; returns how many text bytes were kept.
+ */
+static size_t parseIncoming(char *text, size_t len) {
+    size_t i = 0, kept = 0;
+
+    while (i < len) {
+        if (frame.state == FRAME_TEXT) {
+            char c = text[i++];
+            if (c == FRAME_START) {
+                frame.state = FRAME_HEADER;
+                frame.headerLen = 0;
+            } else if (c != '\0') {
+                text[kept++] = c;
+            }
+        } else if (frame.state == FRAME_HEADER) {
+            frame.header[frame.headerLen++] = text[i++];
+            if (frame.headerLen == FRAME_HEADER_LEN) {
+                uint32_t netLen;
+                memcpy(&netLen, frame.header + 1, sizeof(netLen));
+                frame.left = ntohl(netLen);
+                frame.metaLen = 0;
+                frame.state = FRAME_PAYLOAD;
+                if (frame.left == 0) {
+                    frameComplete();
+                }
+            }
+        } else {
+            size_t n = (len - i < frame.left) ? len - i : frame.left;
+            framePayload(text + i, n);
+            i += n;
+            frame.left -= n;
+            if (frame.left == 0) {
+                frameComplete();
+            }
+        }
+    }
+    return kept;
+}
+
+/*
+ * Moves file data from the socket to disk through a pipe without copying it
+ * into userspace. Returns bytes moved, 0 at end of stream, or -1 with errno.
+ */
+static ssize_t spliceIncoming(int sockfd) {
+    struct pollfd pfd = { sockfd, POLLIN, 0 };
+    size_t want = frame.left < FILE_CHUNK_SIZE ? frame.left : FILE_CHUNK_SIZE;
+    ssize_t moved, out = 0;
+
+    /* The socket is blocking; only splice when there is something to read */
+    if (poll(&pfd, 1, 0) <= 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    moved = splice(sockfd, NULL, splicePipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (moved <= 0) {
+        return moved;
+    }
+    while (out < moved) {
+        ssize_t n = splice(splicePipe[0], NULL, incoming.fd, NULL, moved - out, SPLICE_F_MOVE);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            /* Disk trouble; drain the pipe so the stream stays in step */
+            char sink[BUFFER_SIZE];
+            closeIncoming(n < 0 ? strerror(errno) : "short write");
+            while (out < moved) {
+                n = read(splicePipe[0], sink, (size_t)(moved - out) < sizeof(sink) ? (size_t)(moved - out) : sizeof(sink));
+                if (n <= 0) break;
+                out += n;
+            }
+            break;
+        }
+        out += n;
+    }
+    return moved;
+}
+
+static int isCommand(const char *line, const char *name) {
+    size_t len = strlen(name);
+    return strncmp(line, name, len) == 0 && (line[len] == '\0' || line[len] == '\n');
+}
+
+/* Handles local /commands; returns 0 if the line should be sent to the peer */
+static int handleCommand(const char *line) {
+    struct scrollbackHeader *h = sb.hdr;
+
+    if (isCommand(line, "/back")) {
+        if (h->lines == h->first) {
+            return 1;
+        }
+        sb.view = (sb.view - h->first > SCROLLBACK_PAGE_LINES) ? sb.view - SCROLLBACK_PAGE_LINES : h->first;
+        scrollbackShowPage();
+        return 1;
+    }
+    if (isCommand(line, "/forward")) {
+        if (sb.view == h->lines) {
+            return 1;
+        }
+        sb.view += SCROLLBACK_PAGE_LINES;
+        if (sb.view >= h->lines) {
+            sb.view = h->lines;
+            fprint_to_output("--- end of scrollback ---\n");
+        } else {
+            scrollbackShowPage();
+        }
+        return 1;
+    }
+    if (strncmp(line, "/send ", 6) == 0) {
+        char path[BUFFER_SIZE];
+        snprintf(path, sizeof(path), "%s", line + 6);
+        path[strcspn(path, "\n")] = '\0';
+        startTransfer(path);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Reads what the peer has sent until the socket would block or one screen
+ * buffer's worth has arrived, appending it to the screen buffer with the
+ * message NUL terminators stripped out. Anything left over is picked up on
+ * the next wakeup, so a fast sender cannot starve the keyboard or the repaint.
+ * Returns 0 once the peer has closed the connection.
+ */
+static int drainSocket(int sockfd) {
+    size_t budget = SCREEN_BUFFER_SIZE;
+
+    while (budget > 0) {
+        ssize_t bytesRead;
+        size_t kept, room;
+
+        if (frame.state == FRAME_PAYLOAD && frame.header[0] == FRAME_DATA && incoming.fd >= 0 && splicePipe[0] >= 0) {
+            ssize_t moved = spliceIncoming(sockfd);
+            if (moved > 0) {
+                budget -= ((size_t)moved < budget) ? (size_t)moved : budget;
+                incoming.done += moved;
+                frame.left -= moved;
+                if (frame.left == 0) {
+                    frameComplete();
+                }
+                if (incoming.fd >= 0) {
+                    reportTransfer("Receiving", &incoming, 0);
+                }
+                continue;
+            }
+            if (moved == 0) {
+                return 0;
+            }
+            if (errno == EAGAIN) {
+                return 1;
+            }
+            if (errno != EINTR) {
+                /* No splice support here; fall back to recv */
+                close(splicePipe[0]);
+                close(splicePipe[1]);
+                splicePipe[0] = splicePipe[1] = -1;
+            }
+            continue;
+        }
+        if (screenLen == SCREEN_BUFFER_SIZE) {
+            flushScreen();
+        }
+        room = SCREEN_BUFFER_SIZE - screenLen;
+        bytesRead = recv(sockfd, screenBuffer + screenLen, (room < budget) ? room : budget, MSG_DONTWAIT);
+        if (bytesRead == 0) {
+            return 0;
+        }
+        if (bytesRead < 0) {
+            if (errno == EINTR) continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK);
+        }
+
+        budget -= bytesRead;
+        kept = parseIncoming(screenBuffer + screenLen, bytesRead);
+        scrollbackAppend(screenBuffer + screenLen, kept);
+        screenLen += kept;
+    }
+    return 1;
+}
 
 void chatMode(int sockfd) {
     struct pollfd fds[2];
     char buffer[BUFFER_SIZE + 1];
     int endSession = 0;
+    long long lastPaint = 0;
 
     if (!disableWindowing) {
         start_windowing();
     }
+    sb.view = sb.hdr->lines;
+    memset(&frame, 0, sizeof(frame));
+    if (pipe(splicePipe) < 0) {
+        splicePipe[0] = splicePipe[1] = -1;
+    }
+
+    /* Sends never block, so a slow link cannot freeze typing or the screen */
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+    chatQueueLen = 0;
 
     fds[0].fd = STDIN_FILENO;
-    fds[0].events = POLLIN;
     fds[1].fd = sockfd;
-    fds[1].events = POLLIN;
 
     while (!endSession) {
-        if (poll(fds, 2, -1) == -1) {
+        int timeout = -1;
+        long long now;
+
+        /* Stop taking input while typed lines are stuck behind a file chunk */
+        fds[0].events = (chatQueueLen + BUFFER_SIZE + 1 <= CHAT_QUEUE_SIZE) ? POLLIN : 0;
+        fds[1].events = POLLIN | ((outgoing.fd >= 0 || chatQueueLen > 0) ? POLLOUT : 0);
+
+        /* Wake up in time to paint whatever is still waiting in the screen buffer */
+        if (screenLen > 0) {
+            long long wait = lastPaint + FRAME_INTERVAL_MS - nowMillis();
+            timeout = wait > 0 ? (int)wait : 0;
+        }
+
+        if (poll(fds, 2, timeout) == -1) {
             perror("poll failed");
             exit(EXIT_FAILURE);
         }
@@ -182,35 +1335,267 @@ void chatMode(int sockfd) {
         if (fds[0].revents & POLLIN) {
             update_input_buffer();
             if (has_whole_line()) {
-                memset(buffer, 0, BUFFER_SIZE + 1);
-                if (read_from_input(buffer, BUFFER_SIZE) > 0) {
-                    buffer[strlen(buffer)] = '\0';
-                    send(sockfd, buffer, strlen(buffer) + 1, 0);
-                    if (strncmp(buffer, "bye", 3) == 0) {
-                        endSession = 1;
+                int len = read_from_input(buffer, BUFFER_SIZE);
+                if (len > 0) {
+                    len = stripFrameStart(buffer, len);
+                    buffer[len] = '\0';
+                    if (!handleCommand(buffer)) {
+                        scrollbackAppend(buffer, len);
+                        memcpy(chatQueue + chatQueueLen, buffer, len + 1);
+                        chatQueueLen += len + 1;
+                        if (strncmp(buffer, "bye", 3) == 0) {
+                            endSession = 1;
+                        }
                     }
                 }
             }
         }
 
-        if (fds[1].revents & POLLIN) {
-            memset(buffer, 0, BUFFER_SIZE + 1);
-            ssize_t bytesRead = recv(sockfd, buffer, BUFFER_SIZE, 0);
-            if (bytesRead > 0) {
-                buffer[bytesRead] = '\0';
-                write_to_output(buffer, strlen(buffer));
-            } else if (bytesRead == 0) {
+        if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            if (!drainSocket(sockfd)) {
+                flushScreen();
                 fprint_to_output("Connection closed by peer. ^C to terminate.\n");
                 endSession = 1;
             }
         }
+
+        if (chatQueueLen > 0 || (!endSession && (fds[1].revents & POLLOUT))) {
+            sendPending(sockfd);
+        }
+
+        now = nowMillis();
+        if (screenLen > 0 && (disableWindowing || now - lastPaint >= FRAME_INTERVAL_MS)) {
+            flushScreen();
+            lastPaint = now;
+        }
     }
 
+    /* Get a final "bye" out once the frame in flight is finished */
+    while (chatQueueLen > 0 && sendPending(sockfd) == 0) {
+        struct pollfd out = { sockfd, POLLOUT, 0 };
+        if (poll(&out, 1, PROGRESS_INTERVAL_MS) <= 0) {
+            break;
+        }
+    }
+
+    flushScreen();
+    closeIncoming("connection closed");
+    if (outgoing.fd >= 0) {
+        close(outgoing.fd);
+        outgoing.fd = -1;
+    }
+    outgoing.headerLen = outgoing.headerOff = outgoing.chunkLeft = 0;
+    outgoing.ending = 0;
+    if (splicePipe[0] >= 0) {
+        close(splicePipe[0]);
+        close(splicePipe[1]);
+        splicePipe[0] = splicePipe[1] = -1;
+    }
     if (!disableWindowing) {
         stop_windowing();
     }
 }
 
+static void latencyRecord(struct latencyHistogram *h, long long ns) {
+    uint64_t v = ns > 0 ? (uint64_t)ns : 0;
+    size_t idx = v;
+
+    if (v >= (1 << BENCH_SUB_BITS)) {
+        int shift = (63 - __builtin_clzll(v)) - (BENCH_SUB_BITS - 1);
+        idx = (1 << BENCH_SUB_BITS) + (size_t)(shift - 1) * (1 << (BENCH_SUB_BITS - 1)) +
+              ((v >> shift) - (1 << (BENCH_SUB_BITS - 1)));
+    }
+    h->buckets[idx]++;
+    h->count++;
+    if (ns > h->max) {
+        h->max = ns;
+    }
+}
+
+/* Returns the midpoint of the bucket holding the p'th latency, in microseconds */
+static double latencyPercentile(const struct latencyHistogram *h, double p) {
+    uint64_t rank = (uint64_t)(p * (h->count - 1)) + 1;
+    uint64_t seen = 0;
+    size_t idx;
+
+    for (idx = 0; idx < BENCH_BUCKETS; idx++) {
+        seen += h->buckets[idx];
+        if (seen >= rank) {
+            break;
+        }
+    }
+    if (idx < (1 << BENCH_SUB_BITS)) {
+        return idx / 1000.0;
+    } else {
+        size_t k = idx - (1 << BENCH_SUB_BITS);
+        int shift = k / (1 << (BENCH_SUB_BITS - 1)) + 1;
+        double top = k % (1 << (BENCH_SUB_BITS - 1)) + (1 << (BENCH_SUB_BITS - 1));
+        return (top + 0.5) * (double)(1ULL << shift) / 1000.0;
+    }
+}
+
+/* Handles whole lines from a bot's socket; relayed bench messages carry their send time */
+static void benchReceive(struct benchBot *bot, struct latencyHistogram *latency) {
+    size_t start = 0;
+    char *nl;
+
+    while ((nl = memchr(bot->in + start, '\n', bot->inLen - start)) != NULL) {
+        char *line = bot->in + start;
+        char *stamp;
+        *nl = '\0';
+        start = nl - bot->in + 1;
+
+        if (strcmp(line, "relay: ok") == 0) {
+            bot->ready = 1;
+        } else if ((stamp = strstr(line, ": B ")) != NULL) {
+            latencyRecord(latency, nowNanos() - strtoll(stamp + 4, NULL, 10));
+        }
+    }
+    if (start > 0) {
+        memmove(bot->in, bot->in + start, bot->inLen - start);
+        bot->inLen -= start;
+    } else if (bot->inLen == sizeof(bot->in)) {
+        bot->inLen = 0; /* Oversized line; not one of ours */
+    }
+}
+
+/*
+ * Headless load generator for relay mode. Opens benchClients connections,
+ * has each send benchMessages timestamped lines at benchRate per second, and
+ * measures how long the relay takes to deliver them to the other bots.
+ */
+void runBench(const char *hostname, int port) {
+    struct benchBot *bots;
+    struct pollfd *fds;
+    struct latencyHistogram *latency;
+    long long interval = 1000000000LL / benchRate;
+    long long start, lastSend = 0, lastDelivery = 0, now;
+    long long totalSent = 0, target = (long long)benchClients * benchMessages;
+    int ready = 0;
+    int i;
+
+    signal(SIGPIPE, SIG_IGN);
+    bots = calloc(benchClients, sizeof(*bots));
+    fds = calloc(benchClients, sizeof(*fds));
+    latency = calloc(1, sizeof(*latency));
+    if (bots == NULL || fds == NULL || latency == NULL) error("ERROR allocating bots");
+
+    for (i = 0; i < benchClients; i++) {
+        char name[RELAY_NAME_LEN];
+        int len = snprintf(name, sizeof(name), "bot%d", i);
+        bots[i].fd = connectToServer(hostname, port);
+        send(bots[i].fd, name, len + 1, 0);
+        fds[i].fd = bots[i].fd;
+    }
+
+    /* Send nothing until every bot is in the room so all messages have the same audience */
+    start = nowNanos();
+    now = start;
+    while (1) {
+        int timeout = BENCH_SETTLE_MS;
+
+        if (ready == benchClients) {
+            long long wait;
+            if (totalSent < target) {
+                long long next = -1;
+                for (i = 0; i < benchClients; i++) {
+                    if (bots[i].sent < benchMessages && (next < 0 || bots[i].nextSend < next)) {
+                        next = bots[i].nextSend;
+                    }
+                }
+                wait = next - now;
+            } else {
+                wait = lastSend + BENCH_SETTLE_MS * 1000000LL - now;
+                if (wait <= 0) break;
+            }
+            timeout = wait > 0 ? (int)((wait + 999999) / 1000000) : 0;
+        } else if (now - start > BENCH_SETTLE_MS * 1000000LL) {
+            fprintf(stderr, "Only %d of %d bots were admitted; is the server in relay mode (-r)?\n", ready, benchClients);
+            exit(EXIT_FAILURE);
+        }
+
+        for (i = 0; i < benchClients; i++) {
+            fds[i].events = POLLIN;
+        }
+        if (poll(fds, benchClients, timeout) == -1 && errno != EINTR) {
+            error("poll failed");
+        }
+        now = nowNanos();
+
+        for (i = 0; i < benchClients; i++) {
+            struct benchBot *bot = &bots[i];
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                ssize_t n;
+                while ((n = recv(bot->fd, bot->in + bot->inLen, sizeof(bot->in) - bot->inLen, MSG_DONTWAIT)) > 0) {
+                    int wasReady = bot->ready;
+                    uint64_t before = latency->count;
+                    bot->inLen += n;
+                    benchReceive(bot, latency);
+                    if (latency->count != before) {
+                        lastDelivery = nowNanos();
+                    }
+                    if (!wasReady && bot->ready && ++ready == benchClients) {
+                        /* Stagger the bots across one send interval */
+                        int j;
+                        start = nowNanos();
+                        for (j = 0; j < benchClients; j++) {
+                            bots[j].nextSend = start + interval * j / benchClients;
+                        }
+                    }
+                }
+                if (n == 0) {
+                    fprintf(stderr, "bot%d: connection closed by relay\n", i);
+                    exit(EXIT_FAILURE);
+                }
+            }
+        }
+
+        if (ready < benchClients) {
+            continue;
+        }
+        for (i = 0; i < benchClients; i++) {
+            struct benchBot *bot = &bots[i];
+            while (bot->sent < benchMessages && bot->nextSend <= now) {
+                char msg[64];
+                /*
+                 * Stamp the scheduled time, not the actual one, so a send that
+                 * was held up behind a slow relay still counts its wait as latency
+                 */
+                int len = snprintf(msg, sizeof(msg), "B %lld\n", bot->nextSend);
+                /* Blocking send: a relay that falls behind slows the bots down with it */
+                if (send(bot->fd, msg, len + 1, 0) != len + 1) {
+                    error("ERROR sending bench message");
+                }
+                bot->sent++;
+                bot->nextSend += interval;
+                totalSent++;
+                lastSend = now;
+            }
+        }
+    }
+
+    now = lastSend;
+    for (i = 0; i < benchClients; i++) {
+        close(bots[i].fd);
+    }
+
+    printf("%d clients, %d msg/s each: sent %lld messages in %.2f s (%.0f msg/s)\n",
+           benchClients, benchRate, totalSent, (now - start) / 1e9,
+           now > start ? totalSent / ((now - start) / 1e9) : 0.0);
+    printf("delivered %llu of %lld expected in %.2f s (%.0f msg/s)\n", (unsigned long long)latency->count,
+           totalSent * (benchClients - 1), lastDelivery > start ? (lastDelivery - start) / 1e9 : 0.0,
+           lastDelivery > start ? latency->count / ((lastDelivery - start) / 1e9) : 0.0);
+    if (latency->count > 0) {
+        printf("latency us: p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+               latencyPercentile(latency, 0.50), latencyPercentile(latency, 0.99),
+               latencyPercentile(latency, 0.999), latency->max / 1000.0);
+    }
+
+    free(latency);
+    free(fds);
+    free(bots);
+}
+
 int main(int argc, char *argv[]) {
     char *hostname = NULL;
     int port;
@@ -221,16 +1606,30 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    if (hostname) {
+    if (hostname && benchClients > 0) {
+        if (verbosity > 0) {
+            printf("Running benchmark with %d clients against %s:%d\n", benchClients, hostname, port);
+        }
+        runBench(hostname, port);
+    } else if (hostname) {
         if (verbosity > 0) {
             printf("Running in client mode. Connecting to %s:%d\n", hostname, port);
         }
+        scrollbackOpen(transcriptPath); /* A bad -l fails before we connect */
         runClient(hostname, port);
+        scrollbackClose();
+    } else if (relayMode) {
+        if (verbosity > 0) {
+            printf("Running in relay mode. Listening on port %d\n", port);
+        }
+        runRelay(port);
     } else {
         if (verbosity > 0) {
             printf("Running in server mode. Listening on port %d\n", port);
         }
+        scrollbackOpen(transcriptPath);
         runServer(port);
+        scrollbackClose();
     }
 
     if (!disableWindowing) {
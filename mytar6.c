@@ -1,3 +1,4 @@
+#define _GNU_SOURCE /* copy_file_range */
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -9,11 +10,17 @@
 #include <utime.h>
 #include <errno.h>
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <fnmatch.h>
 
 #define USTAR_MAGIC "ustar"
 #define USTAR_MAGIC_LEN 6
 #define USTAR_VERSION "00"
 #define BLOCK_SIZE 512
+#define RECORD_SIZE (BLOCK_SIZE * 20)
+#define STREAM_CHUNK_SIZE (RECORD_SIZE * 8) /* Bytes moved per read/write on a pipelined stream */
+#define STREAM_BUFFERS 4
 
 struct __attribute__((packed)) ustar_header {
     char name[100];
@@ -35,27 +42,97 @@ struct __attribute__((packed)) ustar_header {
     char pad[12]; /* Adjusted to ensure the struct size is exactly 512 bytes */
 };
 
+/*
+ * Archive I/O goes through an archiveStream. For a seekable archive it is a
+ * thin wrapper around the file descriptor. For "-f -" a helper thread reads
+ * ahead from stdin (or writes behind to stdout) through a ring of
+ * STREAM_BUFFERS chunk buffers, so pipe I/O overlaps with our own work.
+ */
+struct streamBuffer {
+    char data[STREAM_CHUNK_SIZE];
+    size_t len;
+};
+
+struct archiveStream {
+    int fd;
+    int writing;
+    int piped;
+    off_t pos;                  /* Bytes read or written so far */
+    struct streamBuffer *bufs;
+    int head, tail, count;      /* Consumer takes from head, producer fills tail */
+    size_t offset;              /* Main thread's position in its current buffer */
+    size_t curLen;              /* Length of the buffer being read, 0 if none */
+    int done;                   /* Reader hit EOF, or writer was told to finish */
+    int err;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/*
+ * --include/--exclude globs are classified once up front so the common
+ * shapes ("name", "prefix*", "*.ext") are matched with a single memcmp per
+ * header; anything else falls back to fnmatch.
+ */
+enum patternKind { PATTERN_EXACT, PATTERN_PREFIX, PATTERN_SUFFIX, PATTERN_GLOB };
+
+struct pattern {
+    enum patternKind kind;
+    const char *text;           /* Full glob, for PATTERN_GLOB */
+    const char *fixed;          /* Literal part for the other kinds */
+    size_t fixedLen;
+};
+
+struct memberFilter {
+    struct pattern *include;
+    int includeCount;
+    struct pattern *exclude;
+    int excludeCount;
+};
+
 /* Function declarations */
 void fillHeader(struct ustar_header *header, const char *filePath, struct stat *fileStat, char typeflag);
 void createArchive(const char *tarFile, int argc, char *argv[], int verbose, int strict);
-void listContents(const char *tarFile, int verbose, int strict);
-void extractArchive(const char *tarFile, int verbose, int strict);
-void extractFile(int fd, struct ustar_header *hdr, const char *filePath, int verbose);
-void writeHeader(int fd, struct ustar_header *header);
-void writeFileContent(int tarFd, const char *filePath, off_t fileSize);
+void listContents(const char *tarFile, int verbose, int strict, const struct memberFilter *filter);
+void extractArchive(const char *tarFile, int verbose, int strict, const struct memberFilter *filter);
+void concatenateArchives(const char *tarFile, int argc, char *argv[], int verbose, int strict, const struct memberFilter *filter);
+void compilePattern(struct pattern *pat, const char *text);
+int memberSelected(const struct memberFilter *filter, const struct ustar_header *hdr);
+void extractFile(struct archiveStream *s, struct ustar_header *hdr, const char *filePath, int verbose);
+void writeHeader(struct archiveStream *s, struct ustar_header *header);
+void writeFileContent(struct archiveStream *s, const char *filePath, off_t fileSize);
 void calculateChecksum(struct ustar_header *header);
 void printVerboseInfo(const struct ustar_header *hdr); 
 int checkMagicAndVersion(const char *magic, const char *version, int strict); 
 int32_t extract_special_int(char *where, int len);
 int insert_special_int(char *where, size_t size, int32_t val);
-void finalizeArchive(int archiveFd);
+void finalizeArchive(struct archiveStream *s);
+void streamOpen(struct archiveStream *s, const char *tarFile, int writing);
+void streamClose(struct archiveStream *s);
+ssize_t streamRead(struct archiveStream *s, void *buf, size_t len);
+void streamWrite(struct archiveStream *s, const void *buf, size_t len);
+void streamSkip(struct archiveStream *s, off_t len);
+int readHeader(struct archiveStream *s, struct ustar_header *hdr, int strict, const char *what);
 
 int main(int argc, char *argv[]) {
     int opt;
-    int createFlag = 0, listFlag = 0, extractFlag = 0, verboseFlag = 0, strictFlag = 0;
+    int createFlag = 0, listFlag = 0, extractFlag = 0, concatFlag = 0, verboseFlag = 0, strictFlag = 0;
     char *filename = NULL;
+    struct memberFilter filter = {0};
+    static const struct option longOptions[] = {
+        {"include", required_argument, NULL, 'I'},
+        {"exclude", required_argument, NULL, 'X'},
+        {NULL, 0, NULL, 0}
+    };
+
+    filter.include = malloc(argc * sizeof(struct pattern));
+    filter.exclude = malloc(argc * sizeof(struct pattern));
+    if (filter.include == NULL || filter.exclude == NULL) {
+        perror("Failed to allocate patterns");
+        exit(EXIT_FAILURE);
+    }
 
-    while ((opt = getopt(argc, argv, "ctxvf:S")) != -1) {
+    while ((opt = getopt_long(argc, argv, "ctxAvf:S", longOptions, NULL)) != -1) {
         switch (opt) {
             case 'c':
                 createFlag = 1;
@@ -66,6 +143,15 @@ int main(int argc, char *argv[]) {
             case 'x':
                 extractFlag = 1;
                 break;
+            case 'A':
+                concatFlag = 1;
+                break;
+            case 'I':
+                compilePattern(&filter.include[filter.includeCount++], optarg);
+                break;
+            case 'X':
+                compilePattern(&filter.exclude[filter.excludeCount++], optarg);
+                break;
             case 'v':
                 verboseFlag = 1;
                 break;
@@ -76,7 +162,7 @@ int main(int argc, char *argv[]) {
                 strictFlag = 1;
                 break;
             default: /* '?' */
-                fprintf(stderr, "Usage: %s -ctxv -f filename.tar [files...]\n", argv[0]);
+                fprintf(stderr, "Usage: %s -ctxAv [--include glob] [--exclude glob] -f filename.tar|- [files...]\n", argv[0]);
                 exit(EXIT_FAILURE);
         }
     }
@@ -86,17 +172,19 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    if (createFlag + listFlag + extractFlag != 1) {
-        fprintf(stderr, "One of -c, -t, or -x options must be specified.\n");
+    if (createFlag + listFlag + extractFlag + concatFlag != 1) {
+        fprintf(stderr, "One of -c, -t, -x, or -A options must be specified.\n");
         exit(EXIT_FAILURE);
     }
 
     if (createFlag) {
         createArchive(filename, argc - optind, &argv[optind], verboseFlag, strictFlag);
     } else if (listFlag) {
-        listContents(filename, verboseFlag, strictFlag);
+        listContents(filename, verboseFlag, strictFlag, &filter);
     } else if (extractFlag) {
-        extractArchive(filename, verboseFlag, strictFlag);
+        extractArchive(filename, verboseFlag, strictFlag, &filter);
+    } else if (concatFlag) {
+        concatenateArchives(filename, argc - optind, &argv[optind], verboseFlag, strictFlag, &filter);
     }
 
     return 0;
@@ -116,10 +204,11 @@ void calculateChecksum(struct ustar_header *hdr) {
 }
 
 void createArchive(const char *tarFile, int argc, char *argv[], int verbose, int strict) {
-    int tarFd = open(tarFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (tarFd == -1) {
-        perror("Failed to open tar file for writing");
-        exit(EXIT_FAILURE);
+    struct archiveStream archive;
+    FILE *msgOut = stdout;
+    streamOpen(&archive, tarFile, 1);
+    if (archive.fd == STDOUT_FILENO) {
+        msgOut = stderr; /* stdout carries the archive */
     }
 
     struct stat fileStat;
@@ -133,23 +222,21 @@ void createArchive(const char *tarFile, int argc, char *argv[], int verbose, int
 
         char typeflag = S_ISDIR(fileStat.st_mode) ? '5' : S_ISLNK(fileStat.st_mode) ? '2' : '0';
         fillHeader(&hdr, argv[i], &fileStat, typeflag);
-        writeHeader(tarFd, &hdr);
+        writeHeader(&archive, &hdr);
 
         if (typeflag == '0') { /* Regular file */
-            writeFileContent(tarFd, argv[i], fileStat.st_size);
+            writeFileContent(&archive, argv[i], fileStat.st_size);
         }
 
         if (verbose) {
-            printf("Added %s\n", argv[i]);
+            fprintf(msgOut, "Added %s\n", argv[i]);
         }
     }
 
     /* Write two empty blocks as the end of archive marker */
-    char endBlock[BLOCK_SIZE] = {0};
-    write(tarFd, endBlock, BLOCK_SIZE);
-    write(tarFd, endBlock, BLOCK_SIZE);
+    finalizeArchive(&archive);
 
-    close(tarFd);
+    streamClose(&archive);
 }
 
 
@@ -175,51 +262,67 @@ void printVerboseInfo(const struct ustar_header *hdr) {
     printf("%s\n", timebuf);
 }
 
-void listContents(const char *tarFile, int verbose, int strict) {
-    int fd = open(tarFile, O_RDONLY);
-    if (fd == -1) {
-        perror("Failed to open tar file");
+/*
+ * Reads the next header; returns 0 at the end-of-archive marker or at end of
+ * input on a block boundary. A header cut off part way is an error.
+ */
+int readHeader(struct archiveStream *s, struct ustar_header *hdr, int strict, const char *what) {
+    static const char zeros[BLOCK_SIZE];
+    ssize_t n = streamRead(s, hdr, sizeof(struct ustar_header));
+
+    if (n == 0) {
+        return 0;
+    }
+    if (n != sizeof(struct ustar_header)) {
+        fprintf(stderr, "%s: truncated header\n", what);
+        exit(EXIT_FAILURE);
+    }
+    if (memcmp(hdr, zeros, sizeof(zeros)) == 0) {
+        return 0;
+    }
+    if (checkMagicAndVersion(hdr->magic, hdr->version, strict) == 0) { /*Call to checkMagicAndVersion*/
+        fprintf(stderr, "%s\n", what);
         exit(EXIT_FAILURE);
     }
+    return 1;
+}
 
-    struct ustar_header hdr;
-    while (read(fd, &hdr, sizeof(struct ustar_header)) == sizeof(struct ustar_header)) {
-        if (checkMagicAndVersion(hdr.magic, hdr.version, strict) == 0) { /*Call to checkMagicAndVersion*/
-            fprintf(stderr, "Not a valid ustar archive\n");
-            exit(EXIT_FAILURE);
-        }
+void listContents(const char *tarFile, int verbose, int strict, const struct memberFilter *filter) {
+    struct archiveStream archive;
+    streamOpen(&archive, tarFile, 0);
 
-        if (verbose) {
-            printVerboseInfo(&hdr);
-        } else {
-            printf("%s\n", hdr.name);
+    struct ustar_header hdr;
+    while (readHeader(&archive, &hdr, strict, "Not a valid ustar archive")) {
+        if (memberSelected(filter, &hdr)) {
+            if (verbose) {
+                printVerboseInfo(&hdr);
+            } else {
+                printf("%s\n", hdr.name);
+            }
         }
 
         long size;
         sscanf(hdr.size, "%lo", &size);
-        lseek(fd, (size + 511) & ~511, SEEK_CUR); /* Skip to the next header */
+        streamSkip(&archive, (size + 511) & ~511); /* Skip to the next header */
     }
 
-    close(fd);
+    streamClose(&archive);
 }
 
-void extractArchive(const char *tarFile, int verbose, int strict) {
-    int fd = open(tarFile, O_RDONLY);
-    if (fd < 0) {
-        perror("Failed to open archive for extraction");
-        exit(EXIT_FAILURE);
-    }
+void extractArchive(const char *tarFile, int verbose, int strict, const struct memberFilter *filter) {
+    struct archiveStream archive;
+    streamOpen(&archive, tarFile, 0);
 
     struct ustar_header hdr;
-    while (read(fd, &hdr, sizeof(hdr)) == sizeof(hdr)) {
-        if (checkMagicAndVersion(hdr.magic, hdr.version, strict) == 0) { /*Call to checkMagicAndVersion*/
-            fprintf(stderr, "Archive format not recognized or corrupted\n");
-            exit(EXIT_FAILURE);
-        }
-
+    while (readHeader(&archive, &hdr, strict, "Archive format not recognized or corrupted")) {
         long size;
         sscanf(hdr.size, "%lo", &size);
 
+        if (!memberSelected(filter, &hdr)) {
+            streamSkip(&archive, (size + 511) & ~511);
+            continue;
+        }
+
         if (verbose) {
             printf("Extracting %s\n", hdr.name);
         }
@@ -228,36 +331,39 @@ void extractArchive(const char *tarFile, int verbose, int strict) {
         char filePath[256];
         snprintf(filePath, sizeof(filePath), "%s", hdr.name);
 
-        if (hdr.typeflag == '0' || hdr.typeflag == '\0') { /* Regular file */
-            extractFile(fd, &hdr, filePath, verbose);
+        if (hdr.typeflag == '0' || hdr.typeflag == '\0') { /* Regular file; consumes its own payload */
+            extractFile(&archive, &hdr, filePath, verbose);
+            continue;
         } else if (hdr.typeflag == '5') { /* Directory */
             mkdir(filePath, 0755);
         } else if (hdr.typeflag == '2') { /* Symbolic link */
             symlink(hdr.linkname, filePath);
         }
 
-        lseek(fd, (size + 511) & ~511, SEEK_CUR); /* Move to the next header */
+        streamSkip(&archive, (size + 511) & ~511); /* Move to the next header */
     }
 
-    close(fd);
+    streamClose(&archive);
 }
 
-void extractFile(int fd, struct ustar_header *hdr, const char *filePath, int verbose) {
+void extractFile(struct archiveStream *s, struct ustar_header *hdr, const char *filePath, int verbose) {
     int outFileFd = open(filePath, O_WRONLY | O_CREAT | O_TRUNC, strtol(hdr->mode, NULL, 8));
     if (outFileFd == -1) {
         perror("Failed to create output file");
         exit(EXIT_FAILURE);
     }
 
-    char buffer[BLOCK_SIZE];
+    static char buffer[STREAM_CHUNK_SIZE];
     long fileSize;
     sscanf(hdr->size, "%lo", &fileSize);
     ssize_t bytesRemaining = fileSize;
+    ssize_t paddedRemaining = (fileSize + 511) & ~511;
 
-    while (bytesRemaining > 0) {
-        ssize_t bytesRead = read(fd, buffer, sizeof(buffer));
-        if (bytesRead == -1) {
-            perror("Error reading from archive");
+    while (paddedRemaining > 0) {
+        size_t want = (paddedRemaining < (ssize_t)sizeof(buffer)) ? paddedRemaining : sizeof(buffer);
+        ssize_t bytesRead = streamRead(s, buffer, want);
+        if (bytesRead != (ssize_t)want) {
+            fprintf(stderr, "Unexpected end of archive\n");
             exit(EXIT_FAILURE);
         }
 
@@ -268,6 +374,7 @@ void extractFile(int fd, struct ustar_header *hdr, const char *filePath, int ver
         }
 
         bytesRemaining -= bytesToWrite;
+        paddedRemaining -= bytesRead;
     }
 
     close(outFileFd);
@@ -278,6 +385,228 @@ void extractFile(int fd, struct ustar_header *hdr, const char *filePath, int ver
 }
 
 
+void compilePattern(struct pattern *pat, const char *text) {
+    size_t len = strlen(text);
+    size_t metaAt = strcspn(text, "*?[\\");
+
+    pat->text = text;
+    pat->fixed = text;
+    pat->fixedLen = len;
+    if (metaAt == len) {
+        pat->kind = PATTERN_EXACT;
+    } else if (metaAt == len - 1 && text[metaAt] == '*') {
+        pat->kind = PATTERN_PREFIX; /* "prefix*" */
+        pat->fixedLen = len - 1;
+    } else if (metaAt == 0 && text[0] == '*' && strcspn(text + 1, "*?[\\") == len - 1) {
+        pat->kind = PATTERN_SUFFIX; /* "*.ext" */
+        pat->fixed = text + 1;
+        pat->fixedLen = len - 1;
+    } else {
+        pat->kind = PATTERN_GLOB;
+    }
+}
+
+static int matchPattern(const struct pattern *pat, const char *name, size_t len) {
+    switch (pat->kind) {
+        case PATTERN_EXACT:
+            return len == pat->fixedLen && memcmp(name, pat->fixed, len) == 0;
+        case PATTERN_PREFIX:
+            return len >= pat->fixedLen && memcmp(name, pat->fixed, pat->fixedLen) == 0;
+        case PATTERN_SUFFIX:
+            return len >= pat->fixedLen && memcmp(name + len - pat->fixedLen, pat->fixed, pat->fixedLen) == 0;
+        default:
+            return fnmatch(pat->text, name, 0) == 0;
+    }
+}
+
+/* A member is selected if it matches some --include (or there are none) and no --exclude */
+int memberSelected(const struct memberFilter *filter, const struct ustar_header *hdr) {
+    char name[sizeof(hdr->prefix) + 1 + sizeof(hdr->name) + 1];
+    size_t len = 0;
+    int i;
+
+    if (filter->includeCount == 0 && filter->excludeCount == 0) {
+        return 1;
+    }
+
+    if (hdr->prefix[0] != '\0') {
+        len = strnlen(hdr->prefix, sizeof(hdr->prefix));
+        memcpy(name, hdr->prefix, len);
+        name[len++] = '/';
+    }
+    size_t nameLen = strnlen(hdr->name, sizeof(hdr->name));
+    memcpy(name + len, hdr->name, nameLen);
+    len += nameLen;
+    name[len] = '\0';
+
+    for (i = 0; i < filter->excludeCount; i++) {
+        if (matchPattern(&filter->exclude[i], name, len)) {
+            return 0;
+        }
+    }
+    if (filter->includeCount == 0) {
+        return 1;
+    }
+    for (i = 0; i < filter->includeCount; i++) {
+        if (matchPattern(&filter->include[i], name, len)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Copies len bytes between archives in the kernel, falling back to pread/pwrite across filesystems */
+static int copyArchiveRange(int inFd, off_t inPos, int outFd, off_t outPos, off_t len) {
+    static char buffer[STREAM_CHUNK_SIZE];
+
+    while (len > 0) {
+        ssize_t n = copy_file_range(inFd, &inPos, outFd, &outPos, len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+            size_t want = (len < (off_t)sizeof(buffer)) ? len : sizeof(buffer);
+            n = pread(inFd, buffer, want, inPos);
+            if (n > 0 && pwrite(outFd, buffer, n, outPos) != n) {
+                return -1;
+            }
+            inPos += (n > 0) ? n : 0;
+            outPos += (n > 0) ? n : 0;
+        }
+        if (n == 0) {
+            errno = EIO; /* Source shrank under us */
+            return -1;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+/* Writes two empty blocks as the end of archive marker at pos, dropping anything after them */
+static int endArchiveAt(int fd, off_t pos) {
+    char endBlock[BLOCK_SIZE * 2] = {0};
+    if (pwrite(fd, endBlock, sizeof(endBlock), pos) != sizeof(endBlock)) {
+        return -1;
+    }
+    return ftruncate(fd, pos + sizeof(endBlock));
+}
+
+/*
+ * Checks a source archive before anything is written to the destination: it
+ * must be a seekable file other than the destination, and every header must
+ * be valid with its payload fully present.
+ */
+static void checkSourceArchive(const char *path, const struct stat *destStat, int strict) {
+    struct archiveStream src;
+    struct ustar_header hdr;
+    struct stat st;
+
+    if (strcmp(path, "-") == 0) {
+        fprintf(stderr, "-A needs seekable source archives, not -\n");
+        exit(EXIT_FAILURE);
+    }
+    streamOpen(&src, path, 0);
+    if (src.piped || fstat(src.fd, &st) == -1) {
+        fprintf(stderr, "-A needs seekable source archives: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    if (destStat != NULL && st.st_dev == destStat->st_dev && st.st_ino == destStat->st_ino) {
+        fprintf(stderr, "Cannot append %s to itself\n", path);
+        exit(EXIT_FAILURE);
+    }
+    while (readHeader(&src, &hdr, strict, "Not a valid ustar archive")) {
+        long size;
+        sscanf(hdr.size, "%lo", &size);
+        off_t padded = (size + 511) & ~511;
+        if (src.pos + padded > st.st_size) {
+            fprintf(stderr, "%s: member %.100s is truncated\n", path, hdr.name);
+            exit(EXIT_FAILURE);
+        }
+        streamSkip(&src, padded);
+    }
+    streamClose(&src);
+}
+
+/*
+ * Appends the selected members of each source archive to tarFile (creating
+ * it if needed). Headers are walked like -t does; each selected member is
+ * copied header and payload together with copy_file_range.
+ */
+void concatenateArchives(const char *tarFile, int argc, char *argv[], int verbose, int strict, const struct memberFilter *filter) {
+    struct ustar_header hdr;
+    struct stat destStat;
+    int haveDest = (stat(tarFile, &destStat) == 0);
+    off_t destPos = 0;
+    int i;
+
+    if (strcmp(tarFile, "-") == 0 || (haveDest && !S_ISREG(destStat.st_mode))) {
+        fprintf(stderr, "-A needs a seekable archive file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Validate everything up front so a bad source never leaves dest half written */
+    for (i = 0; i < argc; i++) {
+        checkSourceArchive(argv[i], haveDest ? &destStat : NULL, strict);
+    }
+
+    /* New members go where the existing end-of-archive marker starts */
+    if (haveDest) {
+        struct archiveStream dest;
+        streamOpen(&dest, tarFile, 0);
+        while (readHeader(&dest, &hdr, strict, "Not a valid ustar archive")) {
+            long size;
+            sscanf(hdr.size, "%lo", &size);
+            streamSkip(&dest, (size + 511) & ~511);
+            destPos = dest.pos;
+        }
+        streamClose(&dest);
+    }
+    off_t origPos = destPos;
+
+    int destFd = open(tarFile, O_WRONLY | O_CREAT, 0644);
+    if (destFd == -1) {
+        perror("Failed to open tar file for writing");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < argc; i++) {
+        struct archiveStream src;
+        streamOpen(&src, argv[i], 0);
+
+        off_t hdrPos = src.pos;
+        while (readHeader(&src, &hdr, strict, "Not a valid ustar archive")) {
+            long size;
+            sscanf(hdr.size, "%lo", &size);
+            off_t padded = (size + 511) & ~511;
+
+            if (memberSelected(filter, &hdr)) {
+                if (copyArchiveRange(src.fd, hdrPos, destFd, destPos, BLOCK_SIZE + padded) == -1) {
+                    perror("Error copying archive member");
+                    /* Put dest back the way it was */
+                    endArchiveAt(destFd, origPos);
+                    exit(EXIT_FAILURE);
+                }
+                destPos += BLOCK_SIZE + padded;
+                if (verbose) {
+                    printf("Appended %s\n", hdr.name);
+                }
+            }
+            streamSkip(&src, padded);
+            hdrPos = src.pos;
+        }
+        streamClose(&src);
+    }
+
+    if (endArchiveAt(destFd, destPos) == -1) {
+        perror("Error finishing archive");
+        exit(EXIT_FAILURE);
+    }
+    close(destFd);
+}
+
 int checkMagicAndVersion(const char *magic, const char *version, int strict) {
     if (strict) {
         return strncmp(magic, USTAR_MAGIC, USTAR_MAGIC_LEN) == 0 && strncmp(version, USTAR_VERSION, 2) == 0;
@@ -314,7 +643,8 @@ void fillHeader(struct ustar_header *header, const char *filePath, struct stat *
     snprintf(header->mode, sizeof(header->mode), "%07o", fileStat->st_mode & 0777);
     snprintf(header->uid, sizeof(header->uid), "%07o", fileStat->st_uid);
     snprintf(header->gid, sizeof(header->gid), "%07o", fileStat->st_gid);
-    snprintf(header->size, sizeof(header->size), "%011lo", (unsigned long)fileStat->st_size);
+    /* Only regular files carry a payload */
+    snprintf(header->size, sizeof(header->size), "%011lo", typeflag == '0' ? (unsigned long)fileStat->st_size : 0UL);
     snprintf(header->mtime, sizeof(header->mtime), "%011lo", (unsigned long)fileStat->st_mtime);
     header->typeflag = typeflag;
     strncpy(header->magic, USTAR_MAGIC, USTAR_MAGIC_LEN);
@@ -323,35 +653,310 @@ void fillHeader(struct ustar_header *header, const char *filePath, struct stat *
     calculateChecksum(header);
 }
 
-void writeFileContent(int tarFd, const char *filePath, off_t fileSize) {
+void writeFileContent(struct archiveStream *s, const char *filePath, off_t fileSize) {
     int fileFd = open(filePath, O_RDONLY);
     if (fileFd < 0) {
         perror("Error opening file to write content");
         exit(EXIT_FAILURE);
     }
 
-    char buffer[BLOCK_SIZE];
+    static char buffer[STREAM_CHUNK_SIZE];
+    off_t remaining = fileSize;
     ssize_t bytesRead;
-    while ((bytesRead = read(fileFd, buffer, BLOCK_SIZE)) > 0) {
-        write(tarFd, buffer, bytesRead);
-        if (bytesRead < BLOCK_SIZE) {
-            /*Pad the remaining part of the block with zeros*/
-            memset(buffer + bytesRead, 0, BLOCK_SIZE - bytesRead);
-            write(tarFd, buffer + bytesRead, BLOCK_SIZE - bytesRead);
+    while (remaining > 0) {
+        size_t want = (remaining < (off_t)sizeof(buffer)) ? remaining : sizeof(buffer);
+        if ((bytesRead = read(fileFd, buffer, want)) <= 0) {
+            break;
         }
+        streamWrite(s, buffer, bytesRead);
+        remaining -= bytesRead;
     }
     close(fileFd);
+
+    /* Zero-fill if the file shrank since lstat, then pad out the last block */
+    memset(buffer, 0, BLOCK_SIZE);
+    while (remaining > 0) {
+        size_t n = (remaining < BLOCK_SIZE) ? remaining : BLOCK_SIZE;
+        streamWrite(s, buffer, n);
+        remaining -= n;
+    }
+    if (fileSize % BLOCK_SIZE != 0) {
+        streamWrite(s, buffer, BLOCK_SIZE - fileSize % BLOCK_SIZE);
+    }
 }
 
-void writeHeader(int fd, struct ustar_header *header) {
+void writeHeader(struct archiveStream *s, struct ustar_header *header) {
     calculateChecksum(header);
-    if (write(fd, header, sizeof(struct ustar_header)) != sizeof(struct ustar_header)) {
-        perror("Error writing header to archive");
+    streamWrite(s, header, sizeof(struct ustar_header));
+}
+
+void finalizeArchive(struct archiveStream *s) {
+    char endBlock[BLOCK_SIZE * 2] = {0};
+    streamWrite(s, endBlock, sizeof(endBlock));
+}
+
+static ssize_t readFully(int fd, char *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = read(fd, buf + got, len - got);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return (n < 0 && got == 0) ? -1 : (ssize_t)got;
+        }
+        got += n;
+    }
+    return got;
+}
+
+static int writeFully(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Producer side of a piped read: fills free buffers from the archive fd */
+static void *streamReader(void *arg) {
+    struct archiveStream *s = arg;
+    int finished = 0;
+    while (!finished) {
+        pthread_mutex_lock(&s->lock);
+        while (s->count == STREAM_BUFFERS) {
+            pthread_cond_wait(&s->cond, &s->lock);
+        }
+        struct streamBuffer *buf = &s->bufs[s->tail];
+        pthread_mutex_unlock(&s->lock);
+
+        ssize_t n = readFully(s->fd, buf->data, sizeof(buf->data));
+
+        pthread_mutex_lock(&s->lock);
+        if (n > 0) {
+            buf->len = n;
+            s->tail = (s->tail + 1) % STREAM_BUFFERS;
+            s->count++;
+        }
+        if (n < (ssize_t)sizeof(buf->data)) {
+            s->err = (n < 0) ? errno : 0;
+            s->done = 1;
+            finished = 1;
+        }
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+    }
+    return NULL;
+}
+
+/* Consumer side of a piped write: drains filled buffers to the archive fd */
+static void *streamWriter(void *arg) {
+    struct archiveStream *s = arg;
+    while (1) {
+        pthread_mutex_lock(&s->lock);
+        while (s->count == 0 && !s->done) {
+            pthread_cond_wait(&s->cond, &s->lock);
+        }
+        if (s->count == 0) {
+            pthread_mutex_unlock(&s->lock);
+            return NULL;
+        }
+        struct streamBuffer *buf = &s->bufs[s->head];
+        pthread_mutex_unlock(&s->lock);
+
+        if (writeFully(s->fd, buf->data, buf->len) < 0) {
+            perror("Error writing archive");
+            exit(EXIT_FAILURE);
+        }
+
+        pthread_mutex_lock(&s->lock);
+        s->head = (s->head + 1) % STREAM_BUFFERS;
+        s->count--;
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+/* Gives the front buffer back to the reader thread and waits for the next one */
+static int streamNextBuffer(struct archiveStream *s) {
+    pthread_mutex_lock(&s->lock);
+    if (s->curLen > 0) {
+        s->head = (s->head + 1) % STREAM_BUFFERS;
+        s->count--;
+        s->offset = 0;
+        s->curLen = 0;
+        pthread_cond_broadcast(&s->cond);
+    }
+    while (s->count == 0 && !s->done) {
+        pthread_cond_wait(&s->cond, &s->lock);
+    }
+    int more = s->count > 0;
+    if (more) {
+        s->curLen = s->bufs[s->head].len;
+    }
+    if (!more && s->err) {
+        errno = s->err;
+        perror("Error reading archive");
         exit(EXIT_FAILURE);
     }
+    pthread_mutex_unlock(&s->lock);
+    return more;
 }
 
-void finalizeArchive(int archiveFd) {
-    char endBlock[BLOCK_SIZE * 2] = {0};
-    write(archiveFd, endBlock, sizeof(endBlock));
+void streamOpen(struct archiveStream *s, const char *tarFile, int writing) {
+    struct stat st;
+    memset(s, 0, sizeof(*s));
+    s->writing = writing;
+
+    if (strcmp(tarFile, "-") == 0) {
+        s->fd = writing ? STDOUT_FILENO : STDIN_FILENO;
+    } else {
+        s->fd = writing ? open(tarFile, O_WRONLY | O_CREAT | O_TRUNC, 0644) : open(tarFile, O_RDONLY);
+        if (s->fd == -1) {
+            perror(writing ? "Failed to open tar file for writing" : "Failed to open tar file");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Only regular files can seek; pipes, FIFOs, sockets and terminals are streamed */
+    if (fstat(s->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        return;
+    }
+    s->piped = 1;
+    s->bufs = malloc(STREAM_BUFFERS * sizeof(struct streamBuffer));
+    if (s->bufs == NULL) {
+        perror("Failed to allocate stream buffers");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    if (pthread_create(&s->thread, NULL, writing ? streamWriter : streamReader, s) != 0) {
+        fprintf(stderr, "Failed to start stream thread\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void streamClose(struct archiveStream *s) {
+    if (!s->piped) {
+        if (s->fd != STDIN_FILENO && s->fd != STDOUT_FILENO) {
+            close(s->fd);
+        }
+        return;
+    }
+
+    if (s->writing) {
+        pthread_mutex_lock(&s->lock);
+        if (s->offset > 0) {
+            /* Hand over the partly filled buffer */
+            s->bufs[s->tail].len = s->offset;
+            s->tail = (s->tail + 1) % STREAM_BUFFERS;
+            s->count++;
+        }
+        s->done = 1;
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+    } else {
+        /* Drain the rest of the input so the reader thread can finish */
+        while (streamNextBuffer(s)) {
+        }
+    }
+    pthread_join(s->thread, NULL);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->cond);
+    free(s->bufs);
+    if (s->fd != STDIN_FILENO && s->fd != STDOUT_FILENO) {
+        close(s->fd);
+    }
+}
+
+ssize_t streamRead(struct archiveStream *s, void *buf, size_t len) {
+    if (!s->piped) {
+        ssize_t n = readFully(s->fd, buf, len);
+        if (n > 0) {
+            s->pos += n;
+        }
+        return n;
+    }
+
+    size_t got = 0;
+    while (got < len) {
+        if (s->offset == s->curLen && !streamNextBuffer(s)) {
+            break;
+        }
+        size_t n = s->curLen - s->offset;
+        if (n > len - got) {
+            n = len - got;
+        }
+        memcpy((char *)buf + got, s->bufs[s->head].data + s->offset, n);
+        s->offset += n;
+        got += n;
+    }
+    s->pos += got;
+    return got;
+}
+
+/* Skips payload bytes; a pipe cannot seek, so they are consumed from the buffers instead */
+void streamSkip(struct archiveStream *s, off_t len) {
+    if (!s->piped) {
+        s->pos = lseek(s->fd, len, SEEK_CUR);
+        return;
+    }
+
+    while (len > 0) {
+        if (s->offset == s->curLen && !streamNextBuffer(s)) {
+            return;
+        }
+        size_t n = s->curLen - s->offset;
+        if ((off_t)n > len) {
+            n = len;
+        }
+        s->offset += n;
+        s->pos += n;
+        len -= n;
+    }
+}
+
+void streamWrite(struct archiveStream *s, const void *buf, size_t len) {
+    if (!s->piped) {
+        if (writeFully(s->fd, buf, len) < 0) {
+            perror("Error writing archive");
+            exit(EXIT_FAILURE);
+        }
+        s->pos += len;
+        return;
+    }
+
+    s->pos += len;
+    while (len > 0) {
+        struct streamBuffer *cur = &s->bufs[s->tail];
+        size_t n = sizeof(cur->data) - s->offset;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(cur->data + s->offset, buf, n);
+        s->offset += n;
+        buf = (const char *)buf + n;
+        len -= n;
+
+        if (s->offset == sizeof(cur->data)) {
+            /* Publish the full buffer, then wait until the next slot is free */
+            pthread_mutex_lock(&s->lock);
+            cur->len = s->offset;
+            s->tail = (s->tail + 1) % STREAM_BUFFERS;
+            s->count++;
+            s->offset = 0;
+            pthread_cond_broadcast(&s->cond);
+            while (s->count == STREAM_BUFFERS) {
+                pthread_cond_wait(&s->cond, &s->lock);
+            }
+            pthread_mutex_unlock(&s->lock);
+        }
+    }
 }